@@ -10,10 +10,75 @@
 #define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
 
 #include <linux/acpi.h>
+#include <linux/debugfs.h>
 #include <linux/dmi.h>
+#include <linux/io.h>
 #include <linux/kernel.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/overflow.h>
 #include <linux/platform_device.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
+#include <linux/suspend.h>
+#include <linux/timekeeping.h>
+#include <linux/workqueue.h>
+
+static ulong record_mem_address;
+module_param(record_mem_address, ulong, 0400);
+MODULE_PARM_DESC(record_mem_address,
+		 "start of reserved memory region used to persist wake records across reboots");
+
+static ulong record_mem_size;
+module_param(record_mem_size, ulong, 0400);
+MODULE_PARM_DESC(record_mem_size, "size of reserved memory region for wake records");
+
+static bool lid_suspend;
+module_param(lid_suspend, bool, 0444);
+MODULE_PARM_DESC(lid_suspend,
+		 "suspend the system directly on lid close, without a userspace handler (default: false)");
+
+static uint lid_suspend_delay_ms = 1000;
+module_param(lid_suspend_delay_ms, uint, 0644);
+MODULE_PARM_DESC(lid_suspend_delay_ms, "delay between lid close and suspend (default: 1000)");
+
+static const char * const lid_suspend_state_names[] = {
+	[PM_SUSPEND_TO_IDLE] = "s2idle",
+	[PM_SUSPEND_STANDBY] = "shallow",
+	[PM_SUSPEND_MEM] = "deep",
+};
+
+static int lid_suspend_state_set(const char *val, const struct kernel_param *kp)
+{
+	suspend_state_t state;
+
+	for (state = PM_SUSPEND_TO_IDLE; state <= PM_SUSPEND_MEM; state++) {
+		if (sysfs_streq(val, lid_suspend_state_names[state])) {
+			WRITE_ONCE(*(suspend_state_t *)kp->arg, state);
+			return 0;
+		}
+	}
+
+	return -EINVAL;
+}
+
+static int lid_suspend_state_get(char *buffer, const struct kernel_param *kp)
+{
+	suspend_state_t state = READ_ONCE(*(suspend_state_t *)kp->arg);
+
+	return scnprintf(buffer, PAGE_SIZE, "%s\n", lid_suspend_state_names[state]);
+}
+
+static const struct kernel_param_ops lid_suspend_state_ops = {
+	.set = lid_suspend_state_set,
+	.get = lid_suspend_state_get,
+};
+
+static suspend_state_t lid_suspend_state = PM_SUSPEND_TO_IDLE;
+module_param_cb(lid_suspend_state, &lid_suspend_state_ops, &lid_suspend_state, 0644);
+MODULE_PARM_DESC(lid_suspend_state,
+		 "sleep state to enter on lid close, as in /sys/power/mem_sleep: s2idle, shallow, or deep (default: s2idle)");
 
 /*
  * Note: The GPE numbers for the lid devices found below have been obtained
@@ -211,8 +276,130 @@ static const struct dmi_system_id dmi_lid_device_table[] = {
 	{ }
 };
 
+/*
+ * Wake records are kept in a small ring buffer. If a reserved memory region
+ * is provided via the record_mem_* module parameters (analogous to the
+ * ramoops mem_address/mem_size parameters), the ring lives there and
+ * survives a crash or warm reboot, so that records of the previous boot can
+ * be inspected via debugfs. Otherwise, the ring is allocated from normal
+ * memory and only covers the current boot.
+ *
+ * To tell records of a previous boot apart from records of a previous load
+ * of this module within the same boot, the log is tagged with the boot epoch,
+ * i.e. the wall-clock time at which the system booted. This is refreshed on
+ * every record, so that only a clock step of more than the tolerance below
+ * between the last record and a reload makes us mistake it for a new boot.
+ */
+
+#define SURFACE_GPE_RECORD_MAGIC	0x45504753	/* "SGPE" */
+#define SURFACE_GPE_RECORD_VERSION	1
+#define SURFACE_GPE_RECORD_COUNT	32
+
+#define SURFACE_GPE_BOOT_EPOCH_TOLERANCE_NS	(60 * NSEC_PER_SEC)
+
+enum surface_gpe_sleep_state {
+	SURFACE_GPE_STATE_S2IDLE,
+	SURFACE_GPE_STATE_S1,
+	SURFACE_GPE_STATE_S3,
+	SURFACE_GPE_STATE_S4,
+	__SURFACE_GPE_STATE_MAX,
+};
+
+enum surface_gpe_wake_reason {
+	SURFACE_GPE_WAKE_UNKNOWN,
+	SURFACE_GPE_WAKE_LID,
+};
+
+struct surface_gpe_wake_record {
+	u64 suspend_ns;
+	u64 resume_ns;
+	u32 state;
+	u32 reason;
+	u32 gpe_status;
+	u32 reserved;
+	u64 suspend_latency_ns;	/* time spent in the suspend callback */
+	u64 resume_latency_ns;	/* time spent in the resume callback */
+	u32 s2idle_iterations;	/* number of s2idle loop iterations */
+	u32 s2idle_lid_wake;	/* s2idle loop ended with lid GPE pending */
+	u64 s2idle_ns;		/* time spent in s2idle */
+};
+
+/* Statistics of the s2idle loop of the current sleep cycle. */
+struct surface_gpe_s2idle_stats {
+	u64 start_ns;
+	u64 time_ns;
+	u32 iterations;
+	bool lid_wake;
+};
+
+struct surface_gpe_record_log {
+	u32 magic;
+	u32 version;
+	u32 capacity;
+	u32 head;	/* total number of records written */
+	u64 boot_epoch_ns;
+	struct surface_gpe_wake_record records[];
+};
+
+/*
+ * The soak test repeatedly arms and disarms the wake mask of the GPE (and
+ * optionally disables and re-enables the GPE itself) to measure the latency
+ * of these operations and catch failures.
+ */
+
+#define SURFACE_GPE_SOAK_MAX_CYCLES	1000000
+
+enum surface_gpe_soak_op {
+	SURFACE_GPE_SOAK_ARM,
+	SURFACE_GPE_SOAK_DISARM,
+	SURFACE_GPE_SOAK_DISABLE,
+	SURFACE_GPE_SOAK_ENABLE,
+	__SURFACE_GPE_SOAK_OP_MAX,
+};
+
+struct surface_gpe_soak_result {
+	unsigned int samples;
+	unsigned int failures;
+	u64 p50_ns;
+	u64 p95_ns;
+	u64 p99_ns;
+	u64 max_ns;
+};
+
+struct surface_gpe_soak {
+	struct work_struct work;
+	bool running;
+	bool stop;
+	bool toggle;
+	int error;
+	unsigned int cycles;
+	unsigned int done;
+	struct surface_gpe_soak_result result[__SURFACE_GPE_SOAK_OP_MAX];
+};
+
 struct surface_lid_device {
+	struct device *dev;
 	u32 gpe_number;
+
+	struct mutex lock;
+	struct surface_gpe_record_log *log;
+	struct surface_gpe_record_log *last_boot;
+	struct surface_gpe_record_log *log_shadow;
+	size_t log_size;
+	struct surface_gpe_wake_record *current_record;
+	acpi_event_status wake_gpe_status;
+
+	bool armed;
+	unsigned int state_count[__SURFACE_GPE_STATE_MAX];
+
+	struct acpi_device *lid_adev;
+	struct delayed_work suspend_work;
+
+	struct surface_gpe_soak soak;
+
+	struct surface_gpe_s2idle_stats s2idle;
+
+	struct dentry *debugfs;
 };
 
 static int surface_lid_enable_wakeup(struct device *dev, bool enable)
@@ -231,17 +418,857 @@ static int surface_lid_enable_wakeup(struct device *dev, bool enable)
 	return 0;
 }
 
+
+/* -- Wake records. --------------------------------------------------------- */
+
+static u64 surface_gpe_boot_epoch(void)
+{
+	return ktime_get_real_ns() - ktime_get_boottime_ns();
+}
+
+static bool surface_gpe_same_boot(const struct surface_gpe_record_log *log)
+{
+	u64 epoch = surface_gpe_boot_epoch();
+	u64 diff = epoch > log->boot_epoch_ns ? epoch - log->boot_epoch_ns
+					      : log->boot_epoch_ns - epoch;
+
+	return diff < SURFACE_GPE_BOOT_EPOCH_TOLERANCE_NS;
+}
+
+static void surface_gpe_record_log_init(struct surface_gpe_record_log *log, u32 capacity)
+{
+	memset(log->records, 0, flex_array_size(log, records, capacity));
+	log->magic = SURFACE_GPE_RECORD_MAGIC;
+	log->version = SURFACE_GPE_RECORD_VERSION;
+	log->capacity = capacity;
+	log->head = 0;
+	log->boot_epoch_ns = surface_gpe_boot_epoch();
+}
+
+static int surface_gpe_record_setup_persistent(struct device *dev,
+					       struct surface_lid_device *lid)
+{
+	struct surface_gpe_record_log *log;
+	u32 capacity;
+	bool valid;
+
+	if (record_mem_size < struct_size(log, records, 1)) {
+		dev_warn(dev, "wake record memory too small: %lu bytes\n", record_mem_size);
+		return -EINVAL;
+	}
+
+	capacity = min_t(size_t, (record_mem_size - sizeof(*log)) / sizeof(log->records[0]),
+			 U32_MAX);
+
+	log = devm_memremap(dev, record_mem_address, record_mem_size, MEMREMAP_WC);
+	if (IS_ERR(log)) {
+		dev_warn(dev, "failed to map wake record memory: %ld\n", PTR_ERR(log));
+		return PTR_ERR(log);
+	}
+
+	/* Copy kept in the hibernation image, see surface_gpe_freeze(). */
+	lid->log_size = struct_size(log, records, capacity);
+	lid->log_shadow = devm_kmalloc(dev, lid->log_size, GFP_KERNEL);
+	if (!lid->log_shadow)
+		return -ENOMEM;
+
+	valid = log->magic == SURFACE_GPE_RECORD_MAGIC &&
+		log->version == SURFACE_GPE_RECORD_VERSION &&
+		log->capacity == capacity;
+
+	/* Continue the log if the module has been reloaded within this boot. */
+	if (valid && surface_gpe_same_boot(log)) {
+		lid->log = log;
+		return 0;
+	}
+
+	/* Save records left behind by the previous boot, if any. */
+	if (valid && log->head) {
+		lid->last_boot = devm_kmemdup(dev, log, lid->log_size, GFP_KERNEL);
+		if (!lid->last_boot)
+			return -ENOMEM;
+	}
+
+	surface_gpe_record_log_init(log, capacity);
+	lid->log = log;
+	return 0;
+}
+
+static int surface_gpe_record_setup(struct device *dev, struct surface_lid_device *lid)
+{
+	struct surface_gpe_record_log *log;
+	size_t size;
+
+	/*
+	 * The records are for diagnostics only, so don't fail probe and with
+	 * that lid wakeup if the reserved memory region can't be used.
+	 */
+	if (record_mem_address && record_mem_size) {
+		if (!surface_gpe_record_setup_persistent(dev, lid))
+			return 0;
+
+		dev_warn(dev, "falling back to non-persistent wake records\n");
+	}
+
+	size = struct_size(log, records, SURFACE_GPE_RECORD_COUNT);
+
+	log = devm_kzalloc(dev, size, GFP_KERNEL);
+	if (!log)
+		return -ENOMEM;
+
+	surface_gpe_record_log_init(log, SURFACE_GPE_RECORD_COUNT);
+	lid->log = log;
+	return 0;
+}
+
+/*
+ * Records are written on suspend already, so that a system that never
+ * resumes (e.g. due to an empty battery or crash) still leaves a trace. A
+ * resume timestamp of zero thus indicates an incomplete cycle.
+ */
+static void surface_gpe_record_suspend(struct surface_lid_device *lid,
+				       enum surface_gpe_sleep_state state, u64 latency_ns)
+{
+	struct surface_gpe_record_log *log = lid->log;
+	struct surface_gpe_wake_record *rec;
+
+	mutex_lock(&lid->lock);
+
+	rec = &log->records[log->head % log->capacity];
+	rec->suspend_ns = ktime_get_real_ns();
+	rec->resume_ns = 0;
+	rec->state = state;
+	rec->reason = SURFACE_GPE_WAKE_UNKNOWN;
+	rec->gpe_status = 0;
+	rec->suspend_latency_ns = latency_ns;
+	rec->resume_latency_ns = 0;
+	rec->s2idle_iterations = 0;
+	rec->s2idle_lid_wake = 0;
+	rec->s2idle_ns = 0;
+
+	memset(&lid->s2idle, 0, sizeof(lid->s2idle));
+	lid->wake_gpe_status = 0;
+
+	log->head++;
+	log->boot_epoch_ns = surface_gpe_boot_epoch();
+	lid->current_record = rec;
+
+	mutex_unlock(&lid->lock);
+}
+
+/*
+ * The GPE status needs to be sampled before device interrupts are resumed,
+ * i.e. before the SCI gets to run the GPE method, which clears the status.
+ */
+static void surface_gpe_record_wake_status(struct surface_lid_device *lid)
+{
+	acpi_event_status gpe_status = 0;
+	acpi_status status;
+
+	status = acpi_get_gpe_status(NULL, lid->gpe_number, &gpe_status);
+	if (ACPI_FAILURE(status)) {
+		dev_warn(lid->dev, "failed to get GPE status: %s\n",
+			 acpi_format_exception(status));
+		return;
+	}
+
+	lid->wake_gpe_status = gpe_status;
+}
+
+static void surface_gpe_record_resume(struct surface_lid_device *lid, u64 latency_ns)
+{
+	acpi_event_status gpe_status = lid->wake_gpe_status;
+	struct surface_gpe_wake_record *rec;
+
+	mutex_lock(&lid->lock);
+
+	rec = lid->current_record;
+	if (rec) {
+		rec->resume_ns = ktime_get_real_ns();
+		rec->gpe_status = gpe_status;
+		rec->resume_latency_ns = latency_ns;
+		rec->s2idle_iterations = lid->s2idle.iterations;
+		rec->s2idle_lid_wake = lid->s2idle.lid_wake;
+		rec->s2idle_ns = lid->s2idle.time_ns;
+
+		if (gpe_status & ACPI_EVENT_FLAG_STATUS_SET)
+			rec->reason = SURFACE_GPE_WAKE_LID;
+
+		lid->current_record = NULL;
+	}
+
+	mutex_unlock(&lid->lock);
+}
+
+static const char *surface_gpe_sleep_state_str(u32 state)
+{
+	switch (state) {
+	case SURFACE_GPE_STATE_S2IDLE:
+		return "s2idle";
+	case SURFACE_GPE_STATE_S1:
+		return "s1";
+	case SURFACE_GPE_STATE_S3:
+		return "s3";
+	case SURFACE_GPE_STATE_S4:
+		return "s4";
+	default:
+		return "unknown";
+	}
+}
+
+static const char *surface_gpe_wake_reason_str(u32 reason)
+{
+	switch (reason) {
+	case SURFACE_GPE_WAKE_LID:
+		return "lid";
+	default:
+		return "unknown";
+	}
+}
+
+static void surface_gpe_record_show(struct seq_file *s, const struct surface_gpe_record_log *log)
+{
+	u32 count = min(log->head, log->capacity);
+	u32 i;
+
+	for (i = log->head - count; i != log->head; i++) {
+		const struct surface_gpe_wake_record *rec = &log->records[i % log->capacity];
+
+		seq_printf(s, "cycle=%u state=%s suspend=%llu resume=%llu reason=%s gpe_status=0x%x suspend_latency=%llu resume_latency=%llu s2idle_iterations=%u s2idle_lid_wake=%u s2idle_time=%llu\n",
+			   i, surface_gpe_sleep_state_str(rec->state), rec->suspend_ns,
+			   rec->resume_ns, surface_gpe_wake_reason_str(rec->reason),
+			   rec->gpe_status, rec->suspend_latency_ns, rec->resume_latency_ns,
+			   rec->s2idle_iterations, rec->s2idle_lid_wake, rec->s2idle_ns);
+	}
+}
+
+static int wakes_show(struct seq_file *s, void *data)
+{
+	struct surface_lid_device *lid = s->private;
+
+	mutex_lock(&lid->lock);
+	surface_gpe_record_show(s, lid->log);
+	mutex_unlock(&lid->lock);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(wakes);
+
+static int last_boot_wakes_show(struct seq_file *s, void *data)
+{
+	struct surface_lid_device *lid = s->private;
+
+	surface_gpe_record_show(s, lid->last_boot);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(last_boot_wakes);
+
+static int stats_show(struct seq_file *s, void *data)
+{
+	struct surface_lid_device *lid = s->private;
+	int i;
+
+	mutex_lock(&lid->lock);
+
+	for (i = 0; i < __SURFACE_GPE_STATE_MAX; i++)
+		seq_printf(s, "%s: %u\n", surface_gpe_sleep_state_str(i), lid->state_count[i]);
+
+	mutex_unlock(&lid->lock);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(stats);
+
+
+/* -- Suspend on lid close. ------------------------------------------------- */
+
+/*
+ * The GPE method of the lid device notifies the lid device on both close and
+ * open. For setups without a userspace lid handler (e.g. logind), we can
+ * optionally hook into these notifications and suspend the system ourselves.
+ */
+
+#define SURFACE_LID_HID			"PNP0C0D"
+#define SURFACE_LID_NOTIFY_STATUS	0x80
+
+static void surface_lid_suspend_workfn(struct work_struct *work)
+{
+	struct surface_lid_device *lid;
+	suspend_state_t state;
+	int status;
+
+	lid = container_of(to_delayed_work(work), struct surface_lid_device, suspend_work);
+
+	/*
+	 * The mem_sleep setting is not accessible to modules, so the state to
+	 * use is configured explicitly. Never pick a state on our own, as S3
+	 * may be deliberately avoided on devices where it is broken.
+	 */
+	state = READ_ONCE(lid_suspend_state);
+
+	status = pm_suspend(state);
+	if (status)
+		dev_warn(lid->dev, "failed to suspend on lid close: %d\n", status);
+}
+
+static void surface_lid_notify(acpi_handle handle, u32 event, void *data)
+{
+	struct surface_lid_device *lid = data;
+	unsigned long long state;
+	acpi_status status;
+
+	if (event != SURFACE_LID_NOTIFY_STATUS)
+		return;
+
+	status = acpi_evaluate_integer(handle, "_LID", NULL, &state);
+	if (ACPI_FAILURE(status)) {
+		dev_warn(lid->dev, "failed to evaluate lid state: %s\n",
+			 acpi_format_exception(status));
+		return;
+	}
+
+	if (state)
+		cancel_delayed_work(&lid->suspend_work);
+	else
+		mod_delayed_work(system_unbound_wq, &lid->suspend_work,
+				 msecs_to_jiffies(lid_suspend_delay_ms));
+}
+
+static void surface_lid_suspend_setup(struct surface_lid_device *lid)
+{
+	struct acpi_device *adev;
+	acpi_status status;
+
+	if (!lid_suspend)
+		return;
+
+	adev = acpi_dev_get_first_match_dev(SURFACE_LID_HID, NULL, -1);
+	if (!adev) {
+		dev_warn(lid->dev, "no lid device found, not suspending on lid close\n");
+		return;
+	}
+
+	status = acpi_install_notify_handler(acpi_device_handle(adev), ACPI_DEVICE_NOTIFY,
+					     surface_lid_notify, lid);
+	if (ACPI_FAILURE(status)) {
+		dev_warn(lid->dev, "failed to install lid notify handler: %s\n",
+			 acpi_format_exception(status));
+		acpi_dev_put(adev);
+		return;
+	}
+
+	lid->lid_adev = adev;
+}
+
+static void surface_lid_suspend_remove(struct surface_lid_device *lid)
+{
+	if (!lid->lid_adev)
+		return;
+
+	acpi_remove_notify_handler(acpi_device_handle(lid->lid_adev), ACPI_DEVICE_NOTIFY,
+				   surface_lid_notify);
+	cancel_delayed_work_sync(&lid->suspend_work);
+	acpi_dev_put(lid->lid_adev);
+}
+
+
+/* -- S2idle loop statistics. ---------------------------------------------- */
+
+/*
+ * The LPS0 device callbacks are invoked once on entering and leaving the
+ * s2idle loop, and once per loop iteration that did not end the loop (check).
+ * As any pending wake GPE ends the loop, the lid GPE can only ever cause the
+ * final iteration, so its status is sampled only on leaving the loop. These
+ * callbacks run with devices suspended and are thus not concurrent with the
+ * PM callbacks above. As they do not take any arguments, we need to keep
+ * track of the lid device ourselves. This is fine as there can only be one.
+ */
+#if IS_ENABLED(CONFIG_SUSPEND) && IS_ENABLED(CONFIG_X86)
+
+static struct surface_lid_device *s2idle_lid;
+
+static bool surface_gpe_s2idle_gpe_pending(struct surface_lid_device *lid)
+{
+	acpi_event_status status = 0;
+
+	acpi_get_gpe_status(NULL, lid->gpe_number, &status);
+	return status & ACPI_EVENT_FLAG_STATUS_SET;
+}
+
+static void surface_gpe_s2idle_prepare(void)
+{
+	struct surface_lid_device *lid = s2idle_lid;
+
+	lid->s2idle.start_ns = ktime_get_boottime_ns();
+}
+
+static void surface_gpe_s2idle_check(void)
+{
+	struct surface_lid_device *lid = s2idle_lid;
+
+	lid->s2idle.iterations++;
+}
+
+static void surface_gpe_s2idle_restore(void)
+{
+	struct surface_lid_device *lid = s2idle_lid;
+
+	lid->s2idle.time_ns = ktime_get_boottime_ns() - lid->s2idle.start_ns;
+	lid->s2idle.lid_wake = surface_gpe_s2idle_gpe_pending(lid);
+}
+
+static struct acpi_s2idle_dev_ops surface_gpe_s2idle_ops = {
+	.prepare = surface_gpe_s2idle_prepare,
+	.check = surface_gpe_s2idle_check,
+	.restore = surface_gpe_s2idle_restore,
+};
+
+static void surface_gpe_s2idle_setup(struct surface_lid_device *lid)
+{
+	int status;
+
+	s2idle_lid = lid;
+
+	status = acpi_register_lps0_dev(&surface_gpe_s2idle_ops);
+	if (status) {
+		dev_dbg(lid->dev, "s2idle statistics not available: %d\n", status);
+		s2idle_lid = NULL;
+	}
+}
+
+static void surface_gpe_s2idle_remove(struct surface_lid_device *lid)
+{
+	if (!s2idle_lid)
+		return;
+
+	acpi_unregister_lps0_dev(&surface_gpe_s2idle_ops);
+	s2idle_lid = NULL;
+}
+
+#else /* IS_ENABLED(CONFIG_SUSPEND) && IS_ENABLED(CONFIG_X86) */
+
+static void surface_gpe_s2idle_setup(struct surface_lid_device *lid)
+{
+}
+
+static void surface_gpe_s2idle_remove(struct surface_lid_device *lid)
+{
+}
+
+#endif /* IS_ENABLED(CONFIG_SUSPEND) && IS_ENABLED(CONFIG_X86) */
+
+
+/* -- Soak test. ------------------------------------------------------------ */
+
+static int surface_gpe_soak_run_op(struct surface_lid_device *lid, enum surface_gpe_soak_op op)
+{
+	acpi_status status;
+
+	switch (op) {
+	case SURFACE_GPE_SOAK_ARM:
+		return surface_lid_enable_wakeup(lid->dev, true);
+
+	case SURFACE_GPE_SOAK_DISARM:
+		return surface_lid_enable_wakeup(lid->dev, false);
+
+	case SURFACE_GPE_SOAK_DISABLE:
+		status = acpi_disable_gpe(NULL, lid->gpe_number);
+		break;
+
+	case SURFACE_GPE_SOAK_ENABLE:
+		status = acpi_enable_gpe(NULL, lid->gpe_number);
+		break;
+
+	default:
+		return -EINVAL;
+	}
+
+	return ACPI_FAILURE(status) ? -EIO : 0;
+}
+
+static int surface_gpe_soak_cmp(const void *a, const void *b)
+{
+	u64 x = *(const u64 *)a;
+	u64 y = *(const u64 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static u64 surface_gpe_soak_percentile(const u64 *sorted, unsigned int n, unsigned int p)
+{
+	unsigned int rank = DIV_ROUND_UP(p * n, 100);
+
+	return sorted[max(rank, 1U) - 1];
+}
+
+static void surface_gpe_soak_eval(struct surface_gpe_soak_result *res, u64 *latency,
+				  unsigned int n)
+{
+	if (!n)
+		return;
+
+	sort(latency, n, sizeof(*latency), surface_gpe_soak_cmp, NULL);
+
+	res->p50_ns = surface_gpe_soak_percentile(latency, n, 50);
+	res->p95_ns = surface_gpe_soak_percentile(latency, n, 95);
+	res->p99_ns = surface_gpe_soak_percentile(latency, n, 99);
+	res->max_ns = latency[n - 1];
+}
+
+static void surface_gpe_soak_workfn(struct work_struct *work)
+{
+	struct surface_lid_device *lid = container_of(work, struct surface_lid_device, soak.work);
+	struct surface_gpe_soak *soak = &lid->soak;
+	struct surface_gpe_soak_result result[__SURFACE_GPE_SOAK_OP_MAX] = {};
+	u64 *latency[__SURFACE_GPE_SOAK_OP_MAX] = {};
+	unsigned int nops, op, i, flags;
+	int disabled = 0;
+	int error = 0;
+
+	nops = soak->toggle ? __SURFACE_GPE_SOAK_OP_MAX : SURFACE_GPE_SOAK_DISABLE;
+
+	for (op = 0; op < nops; op++) {
+		latency[op] = kvmalloc_array(soak->cycles, sizeof(u64), GFP_KERNEL);
+		if (!latency[op]) {
+			error = -ENOMEM;
+			i = 0;
+			goto out;
+		}
+	}
+
+	for (i = 0; i < soak->cycles && !READ_ONCE(soak->stop); i++) {
+		bool disable_failed = false;
+
+		/* Don't interfere with arming/disarming in system sleep transitions. */
+		flags = lock_system_sleep();
+
+		for (op = 0; op < nops; op++) {
+			struct surface_gpe_soak_result *res = &result[op];
+			u64 start;
+			int status;
+
+			/*
+			 * Enabling the GPE without having disabled it first would
+			 * take an additional reference, so skip it in that case.
+			 */
+			if (op == SURFACE_GPE_SOAK_ENABLE && disable_failed)
+				continue;
+
+			start = ktime_get_ns();
+			status = surface_gpe_soak_run_op(lid, op);
+			latency[op][res->samples++] = ktime_get_ns() - start;
+
+			if (status) {
+				res->failures++;
+
+				if (op == SURFACE_GPE_SOAK_DISABLE)
+					disable_failed = true;
+			} else if (op == SURFACE_GPE_SOAK_DISABLE) {
+				disabled++;
+			} else if (op == SURFACE_GPE_SOAK_ENABLE) {
+				disabled--;
+			}
+		}
+
+		unlock_system_sleep(flags);
+
+		WRITE_ONCE(soak->done, i + 1);
+		cond_resched();
+	}
+
+	/* Restore the original state, undoing any half-completed cycles. */
+	flags = lock_system_sleep();
+
+	for (; disabled > 0; disabled--)
+		acpi_enable_gpe(NULL, lid->gpe_number);
+
+	surface_lid_enable_wakeup(lid->dev, lid->armed);
+
+	unlock_system_sleep(flags);
+
+	for (op = 0; op < nops; op++)
+		surface_gpe_soak_eval(&result[op], latency[op], result[op].samples);
+
+out:
+	for (op = 0; op < nops; op++)
+		kvfree(latency[op]);
+
+	mutex_lock(&lid->lock);
+	memcpy(soak->result, result, sizeof(result));
+	soak->error = error;
+	soak->done = i;
+	soak->running = false;
+	mutex_unlock(&lid->lock);
+}
+
+static int surface_gpe_soak_start(struct surface_lid_device *lid, unsigned int cycles, bool toggle)
+{
+	struct surface_gpe_soak *soak = &lid->soak;
+	int status = 0;
+
+	if (!cycles || cycles > SURFACE_GPE_SOAK_MAX_CYCLES)
+		return -EINVAL;
+
+	mutex_lock(&lid->lock);
+
+	if (soak->running) {
+		status = -EBUSY;
+		goto out;
+	}
+
+	memset(soak->result, 0, sizeof(soak->result));
+	soak->running = true;
+	soak->toggle = toggle;
+	soak->error = 0;
+	soak->cycles = cycles;
+	soak->done = 0;
+
+	queue_work(system_long_wq, &soak->work);
+
+out:
+	mutex_unlock(&lid->lock);
+	return status;
+}
+
+static void surface_gpe_soak_remove(struct surface_lid_device *lid)
+{
+	WRITE_ONCE(lid->soak.stop, true);
+	cancel_work_sync(&lid->soak.work);
+}
+
+static const char *surface_gpe_soak_op_str(enum surface_gpe_soak_op op)
+{
+	switch (op) {
+	case SURFACE_GPE_SOAK_ARM:
+		return "arm";
+	case SURFACE_GPE_SOAK_DISARM:
+		return "disarm";
+	case SURFACE_GPE_SOAK_DISABLE:
+		return "disable";
+	case SURFACE_GPE_SOAK_ENABLE:
+		return "enable";
+	default:
+		return "unknown";
+	}
+}
+
+static int soak_show(struct seq_file *s, void *data)
+{
+	struct surface_lid_device *lid = s->private;
+	struct surface_gpe_soak *soak = &lid->soak;
+	unsigned int nops, op;
+
+	mutex_lock(&lid->lock);
+
+	seq_printf(s, "status: %s\n", soak->running ? "running" : "idle");
+	seq_printf(s, "cycles: %u/%u\n", READ_ONCE(soak->done), soak->cycles);
+
+	if (soak->error)
+		seq_printf(s, "error: %d\n", soak->error);
+
+	nops = soak->toggle ? __SURFACE_GPE_SOAK_OP_MAX : SURFACE_GPE_SOAK_DISABLE;
+
+	for (op = 0; op < nops && !soak->running && soak->done; op++) {
+		const struct surface_gpe_soak_result *res = &soak->result[op];
+
+		seq_printf(s, "%s: samples=%u failures=%u p50=%llu p95=%llu p99=%llu max=%llu\n",
+			   surface_gpe_soak_op_str(op), res->samples, res->failures,
+			   res->p50_ns, res->p95_ns, res->p99_ns, res->max_ns);
+	}
+
+	mutex_unlock(&lid->lock);
+	return 0;
+}
+
+static int soak_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, soak_show, inode->i_private);
+}
+
+/*
+ * Start a soak test by writing "<cycles> [<toggle>]", where a non-zero
+ * toggle value additionally disables and re-enables the GPE in each cycle.
+ */
+static ssize_t soak_write(struct file *file, const char __user *ubuf, size_t count,
+			  loff_t *ppos)
+{
+	struct surface_lid_device *lid = ((struct seq_file *)file->private_data)->private;
+	unsigned int cycles, toggle = 0;
+	char buf[32] = {};
+	ssize_t len;
+	int status;
+
+	len = simple_write_to_buffer(buf, sizeof(buf) - 1, ppos, ubuf, count);
+	if (len < 0)
+		return len;
+
+	if (sscanf(buf, "%u %u", &cycles, &toggle) < 1)
+		return -EINVAL;
+
+	status = surface_gpe_soak_start(lid, cycles, toggle);
+	if (status)
+		return status;
+
+	return len;
+}
+
+static const struct file_operations soak_fops = {
+	.owner = THIS_MODULE,
+	.open = soak_open,
+	.read = seq_read,
+	.write = soak_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+
+/* -- Debugfs interface. ---------------------------------------------------- */
+
+static void surface_gpe_debugfs_init(struct surface_lid_device *lid)
+{
+	lid->debugfs = debugfs_create_dir("surface_gpe", NULL);
+
+	debugfs_create_file("stats", 0400, lid->debugfs, lid, &stats_fops);
+	debugfs_create_file("soak", 0600, lid->debugfs, lid, &soak_fops);
+
+	debugfs_create_file("wakes", 0400, lid->debugfs, lid, &wakes_fops);
+
+	if (lid->last_boot)
+		debugfs_create_file("last_boot_wakes", 0400, lid->debugfs, lid,
+				    &last_boot_wakes_fops);
+}
+
+
+/* -- Driver setup. --------------------------------------------------------- */
+
+/*
+ * All of s2idle, S1, S3, and S4 rely on the wake mask of the GPE being set, as
+ * ACPICA enables only wake GPEs when entering the respective state. For
+ * s2idle, the GPE additionally needs to stay enabled as runtime GPE, which is
+ * ensured by enabling it on probe and never disabling it while bound. There
+ * is no need to touch the GPE at all for the freeze/thaw transitions of
+ * hibernation, as the system does not go to sleep there.
+ */
+static int surface_gpe_arm(struct device *dev, enum surface_gpe_sleep_state state)
+{
+	struct surface_lid_device *lid = dev_get_drvdata(dev);
+	u64 start = ktime_get_ns();
+	int status;
+
+	mutex_lock(&lid->lock);
+	lid->state_count[state]++;
+	mutex_unlock(&lid->lock);
+
+	/* Don't suspend again right after resume due to a stale lid event. */
+	cancel_delayed_work(&lid->suspend_work);
+
+	status = surface_lid_enable_wakeup(dev, true);
+	if (status)
+		return status;
+
+	lid->armed = true;
+
+	/*
+	 * Records for S4 would be lost on restore, as the log is restored
+	 * from the copy taken on freeze, which predates the poweroff.
+	 */
+	if (state != SURFACE_GPE_STATE_S4)
+		surface_gpe_record_suspend(lid, state, ktime_get_ns() - start);
+
+	return 0;
+}
+
+static int surface_gpe_disarm(struct device *dev)
+{
+	struct surface_lid_device *lid = dev_get_drvdata(dev);
+	u64 start = ktime_get_ns();
+	int status = 0;
+
+	if (lid->armed) {
+		status = surface_lid_enable_wakeup(dev, false);
+		if (!status)
+			lid->armed = false;
+	}
+
+	surface_gpe_record_resume(lid, ktime_get_ns() - start);
+	return status;
+}
+
 static int __maybe_unused surface_gpe_suspend(struct device *dev)
 {
-	return surface_lid_enable_wakeup(dev, true);
+	enum surface_gpe_sleep_state state;
+
+	if (pm_suspend_target_state == PM_SUSPEND_TO_IDLE || !pm_suspend_via_firmware())
+		state = SURFACE_GPE_STATE_S2IDLE;
+	else if (pm_suspend_target_state == PM_SUSPEND_MEM)
+		state = SURFACE_GPE_STATE_S3;
+	else
+		state = SURFACE_GPE_STATE_S1;
+
+	return surface_gpe_arm(dev, state);
+}
+
+static int __maybe_unused surface_gpe_poweroff(struct device *dev)
+{
+	return surface_gpe_arm(dev, SURFACE_GPE_STATE_S4);
+}
+
+static int __maybe_unused surface_gpe_resume_noirq(struct device *dev)
+{
+	struct surface_lid_device *lid = dev_get_drvdata(dev);
+
+	if (lid->current_record)
+		surface_gpe_record_wake_status(lid);
+
+	return 0;
 }
 
 static int __maybe_unused surface_gpe_resume(struct device *dev)
 {
-	return surface_lid_enable_wakeup(dev, false);
+	return surface_gpe_disarm(dev);
+}
+
+/*
+ * The reserved memory region holding the records is not part of the
+ * hibernation image, and the kernel restoring the image takes it over as log
+ * of a previous boot if it loads this module. So keep a copy of the log in
+ * the image and write it back on restore.
+ */
+static int __maybe_unused surface_gpe_freeze(struct device *dev)
+{
+	struct surface_lid_device *lid = dev_get_drvdata(dev);
+
+	if (lid->log_shadow) {
+		mutex_lock(&lid->lock);
+		memcpy(lid->log_shadow, lid->log, lid->log_size);
+		mutex_unlock(&lid->lock);
+	}
+
+	return 0;
 }
 
-static SIMPLE_DEV_PM_OPS(surface_gpe_pm, surface_gpe_suspend, surface_gpe_resume);
+static int __maybe_unused surface_gpe_restore(struct device *dev)
+{
+	struct surface_lid_device *lid = dev_get_drvdata(dev);
+
+	if (lid->log_shadow) {
+		mutex_lock(&lid->lock);
+		memcpy(lid->log, lid->log_shadow, lid->log_size);
+		mutex_unlock(&lid->lock);
+	}
+
+	return surface_gpe_disarm(dev);
+}
+
+static const struct dev_pm_ops surface_gpe_pm = {
+#ifdef CONFIG_PM_SLEEP
+	.suspend = surface_gpe_suspend,
+	.resume = surface_gpe_resume,
+	.freeze = surface_gpe_freeze,
+	.poweroff = surface_gpe_poweroff,
+	.restore = surface_gpe_restore,
+	.resume_noirq = surface_gpe_resume_noirq,
+#endif
+};
 
 static int surface_gpe_probe(struct platform_device *pdev)
 {
@@ -260,7 +1287,11 @@ static int surface_gpe_probe(struct platform_device *pdev)
 	if (!lid)
 		return -ENOMEM;
 
+	lid->dev = &pdev->dev;
 	lid->gpe_number = gpe_number;
+	mutex_init(&lid->lock);
+	INIT_DELAYED_WORK(&lid->suspend_work, surface_lid_suspend_workfn);
+	INIT_WORK(&lid->soak.work, surface_gpe_soak_workfn);
 	platform_set_drvdata(pdev, lid);
 
 	status = acpi_mark_gpe_for_wake(NULL, gpe_number);
@@ -278,16 +1309,36 @@ static int surface_gpe_probe(struct platform_device *pdev)
 	}
 
 	ret = surface_lid_enable_wakeup(&pdev->dev, false);
-	if (ret)
+	if (ret) {
+		acpi_disable_gpe(NULL, gpe_number);
+		return ret;
+	}
+
+	/*
+	 * Set up records only once the GPE is set up, so that records of the
+	 * previous boot are not discarded if probing fails.
+	 */
+	ret = surface_gpe_record_setup(&pdev->dev, lid);
+	if (ret) {
 		acpi_disable_gpe(NULL, gpe_number);
+		return ret;
+	}
 
-	return ret;
+	surface_lid_suspend_setup(lid);
+	surface_gpe_s2idle_setup(lid);
+	surface_gpe_debugfs_init(lid);
+	return 0;
 }
 
 static void surface_gpe_remove(struct platform_device *pdev)
 {
 	struct surface_lid_device *lid = dev_get_drvdata(&pdev->dev);
 
+	debugfs_remove_recursive(lid->debugfs);
+	surface_gpe_s2idle_remove(lid);
+	surface_gpe_soak_remove(lid);
+	surface_lid_suspend_remove(lid);
+
 	/* restore default behavior without this module */
 	surface_lid_enable_wakeup(&pdev->dev, false);
 	acpi_disable_gpe(NULL, lid->gpe_number);